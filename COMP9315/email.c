@@ -12,28 +12,22 @@
 #include "fmgr.h"
 #include "libpq/pqformat.h"		/* needed for send/recv functions */
 #include "access/hash.h"
+#include "access/gist.h"
+#include "catalog/pg_type.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "port/pg_bitutils.h"
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "email_parse.h"
 
 
-PG_MODULE_MAGIC;
-
-void checkString(char *str);
 
-//Switch to the new struct
-typedef struct Email
-{
-	/* The structure will contain both Local and Domain part of 1 Email Address
-	 * Local@Domain#
-	 * Follow the statement there is no sign except . and - in the string
-	 * So we can use @ and # to compute the length of local and domain part
-	 * The maximum string will be 129 + 129 + 1(for @) + 1(for #);
-	 */
-	char data[260];
-}	Email;
+PG_MODULE_MAGIC;
 
 /*
  * Since we use V1 function calling convention, all these functions have
@@ -41,6 +35,9 @@ typedef struct Email
  * just to forestall warnings when compiled with gcc -Wmissing-prototypes.
  */
 Datum		email_in(PG_FUNCTION_ARGS);
+Datum		email_typmod_in(PG_FUNCTION_ARGS);
+Datum		email_typmod_out(PG_FUNCTION_ARGS);
+Datum		email_enforce_typmod(PG_FUNCTION_ARGS);
 Datum		email_out(PG_FUNCTION_ARGS);
 Datum		email_recv(PG_FUNCTION_ARGS);
 Datum		email_send(PG_FUNCTION_ARGS);
@@ -54,142 +51,137 @@ Datum		email_lt_eq(PG_FUNCTION_ARGS);
 Datum		email_not_domain_eq(PG_FUNCTION_ARGS);
 Datum		email_cmp(PG_FUNCTION_ARGS);
 Datum		email_hash(PG_FUNCTION_ARGS);
+Datum		email_domain_in_set(PG_FUNCTION_ARGS);
+Datum		email_domain(PG_FUNCTION_ARGS);
+Datum		email_fingerprint(PG_FUNCTION_ARGS);
+Datum		fingerprint_in(PG_FUNCTION_ARGS);
+Datum		fingerprint_out(PG_FUNCTION_ARGS);
+Datum		fingerprint_recv(PG_FUNCTION_ARGS);
+Datum		fingerprint_send(PG_FUNCTION_ARGS);
+Datum		fingerprint_eq(PG_FUNCTION_ARGS);
+Datum		fingerprint_not_eq(PG_FUNCTION_ARGS);
+Datum		fingerprint_lt(PG_FUNCTION_ARGS);
+Datum		fingerprint_lt_eq(PG_FUNCTION_ARGS);
+Datum		fingerprint_gt(PG_FUNCTION_ARGS);
+Datum		fingerprint_gt_eq(PG_FUNCTION_ARGS);
+Datum		fingerprint_cmp(PG_FUNCTION_ARGS);
+Datum		fingerprint_hash(PG_FUNCTION_ARGS);
+Datum		email_canonical(PG_FUNCTION_ARGS);
+Datum		email_canon_eq(PG_FUNCTION_ARGS);
+Datum		email_canon_not_eq(PG_FUNCTION_ARGS);
+Datum		email_canon_lt(PG_FUNCTION_ARGS);
+Datum		email_canon_lt_eq(PG_FUNCTION_ARGS);
+Datum		email_canon_gt(PG_FUNCTION_ARGS);
+Datum		email_canon_gt_eq(PG_FUNCTION_ARGS);
+Datum		email_canon_cmp(PG_FUNCTION_ARGS);
+Datum		email_canon_hash(PG_FUNCTION_ARGS);
+Datum		email_distance(PG_FUNCTION_ARGS);
+Datum		email_gist_key_in(PG_FUNCTION_ARGS);
+Datum		email_gist_key_out(PG_FUNCTION_ARGS);
+Datum		email_gist_consistent(PG_FUNCTION_ARGS);
+Datum		email_gist_union(PG_FUNCTION_ARGS);
+Datum		email_gist_compress(PG_FUNCTION_ARGS);
+Datum		email_gist_decompress(PG_FUNCTION_ARGS);
+Datum		email_gist_penalty(PG_FUNCTION_ARGS);
+Datum		email_gist_picksplit(PG_FUNCTION_ARGS);
+Datum		email_gist_same(PG_FUNCTION_ARGS);
+Datum		email_gist_distance(PG_FUNCTION_ARGS);
 
 /*****************************************************************************
  * Input/Output functions
  *****************************************************************************/
 
+/*
+ * EmailAddress(n) limits "local@domain" to n characters. The shortest valid
+ * address is "a@b.c", the longest is two 128 character parts and the '@'.
+ */
+#define EMAIL_TYPMOD_MIN 5
+#define EMAIL_TYPMOD_MAX (EMAIL_PART_MAX * 2 + 1)
+
+static void
+emailCheckTypmod(Email *email, int32 typmod)
+{
+	int		len;
+
+	if (typmod < 0)
+		return;
+	len = strchr(email->data, '#') - email->data;
+	if (len > typmod) {
+		ereport(ERROR,
+		(errcode(ERRCODE_STRING_DATA_RIGHT_TRUNCATION),
+		 errmsg("Error: Email address is longer than %d characters", typmod)));
+	}
+}
+
 PG_FUNCTION_INFO_V1(email_in);
 
 Datum
 email_in(PG_FUNCTION_ARGS)
 {
-	char   *local;
-	char   *domain;
-	char *in = (char *) PG_GETARG_POINTER(0);
-	int count;
-	int isDomain;
-	char *str;	
-	char *delimiter;
-	Email    *result; 
-		
-	local = (char *) palloc0(129);
-    	domain = (char *) palloc0(129);
-	*domain = '\0';
-	*local = '\0';
-	isDomain = 0;
-	str = local;
-	count = 0;
-
-	while (*in != '\0') {
-		if (*in == '@') {
-			if (isDomain == 0) {
-				isDomain = 1;
-				count = 0;
-				*str = '\0';
-				str = domain;
-			}
-			else {
-				ereport(ERROR, 
-				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-				 errmsg("Error: Cannot have more than one '@' in an email")));
-			}
-		}
-		else {
-			if (count == 128) {
-				ereport(ERROR, 
-				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-				 errmsg("Error: Only 128 characters allowed in Local or Domain part")));
-			}
-			*str++ = tolower(*in);
-			count++;
-		}
-		in++;
+	//The parser itself lives in email_parse.h, shared with email_validate
+	char *in = PG_GETARG_CSTRING(0);
+	int32 typmod = PG_NARGS() > 2 ? PG_GETARG_INT32(2) : -1;
+	Email    *result = (Email *) palloc0(sizeof(Email));
+	const char *error = emailParse(in, strlen(in), result);
+
+	if (error != NULL) {
+		ereport(ERROR,
+		(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+		 errmsg("%s", error)));
 	}
+	emailCheckTypmod(result, typmod);
 
-	*str = '\0';
-	str = local;
-    	checkString(str);
-	str = domain;
-	//In the case of Domain part we have to add this check before the main check above
-	//Special check if there is a . exist in the string  
-	delimiter = strchr(domain,'.');
-   	if(delimiter==NULL){
-		ereport(ERROR, 
-		(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-		 errmsg("Error: Domain part must contain at least one '.'")));  
-    	}
-	checkString(str);
-	result = (Email *) palloc0(sizeof(Email)); 
-	//Now we copy the content of email address to our data
-	//Remember the length of the local
+	PG_RETURN_POINTER(result);
+}
 
+PG_FUNCTION_INFO_V1(email_typmod_in);
+Datum
+email_typmod_in(PG_FUNCTION_ARGS)
+{
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(0);
+	int32	   *mods;
+	int		n;
+
+	mods = ArrayGetIntegerTypmods(array, &n);
+	if (n != 1) {
+		ereport(ERROR,
+		(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		 errmsg("Error: EmailAddress takes exactly one length")));
+	}
+	if (mods[0] < EMAIL_TYPMOD_MIN || mods[0] > EMAIL_TYPMOD_MAX) {
+		ereport(ERROR,
+		(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		 errmsg("Error: Length for EmailAddress must be between %d and %d",
+				EMAIL_TYPMOD_MIN, EMAIL_TYPMOD_MAX)));
+	}
 
-	//Adding the region to output result
-	memmove(result->data,local,strlen(local));
-	str = result->data;
-	str = str+strlen(local);
-	*str = '@';
-	str++;	
-	memmove(str , domain , strlen(domain) );
-	str = str+strlen(domain);
-	*str = '#';
-	str++;
-	*str = '\0';
-	//Now return the result and free the alloc before that
-	pfree(local);
-	pfree(domain);
-	
-	PG_RETURN_POINTER(result);
+	PG_RETURN_INT32(mods[0]);
 }
 
-//Function to check the content of Local and Domain part of EmailAddress
-void checkString(char *str) {
+PG_FUNCTION_INFO_V1(email_typmod_out);
+Datum
+email_typmod_out(PG_FUNCTION_ARGS)
+{
+	int32	typmod = PG_GETARG_INT32(0);
+	char   *result = (char *) palloc(16);
 
-	//Check the first character of the part is a letter
-    	if(!isalpha(*str)){
-        	ereport(ERROR, 
-		(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-		errmsg("Error: Only a letter can begin a word")));
-   	 }
-
-    	//Loop through the part
-    	//Check if there is another sign except . amd - in the string
-    	//Check the format of the rest
-    	while(*str != '\0'){
-        	if(!isalnum(*str)){
-        
-            		if(*str != '.' && *str != '-'){
-				ereport(ERROR, 
-				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-		 		errmsg("Error: Only letters, numbers, '.', and '-' allowed")));
-            		}
-            		//Check if after a . there is only letter
-            		if(*str=='.'){
-                		//A word begin with a letter
-                		if(!isalpha(*(str+1))){
-					ereport(ERROR, 
-					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-		 			errmsg("Error: Only a letter can begin a word")));
-                		}
-                		//A word end with a letter or digit
-                		if(!isalnum(*(str-1))){
-					ereport(ERROR, 
-					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-		 			errmsg("Error: Only a letter or digit can end a word")));
-                		}
-			}
-            	}
-		str++;
-        }
-    
-    	//Last check if the end is a number or a digit
-    	if(!isalnum(*(str-1))){
-        	ereport(ERROR, 
-		(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-		errmsg("Error: Only a letter or dtempigit can end a word")));
-    	}
+	if (typmod >= 0)
+		snprintf(result, 16, "(%d)", typmod);
+	else
+		*result = '\0';
+	PG_RETURN_CSTRING(result);
+}
+
+//Length coercion cast, applied when a value is stored into EmailAddress(n)
+PG_FUNCTION_INFO_V1(email_enforce_typmod);
+Datum
+email_enforce_typmod(PG_FUNCTION_ARGS)
+{
+	Email    *email = (Email *) PG_GETARG_POINTER(0);
 
+	//Truncating would give a different address, so explicit casts fail too
+	emailCheckTypmod(email, PG_GETARG_INT32(1));
+	PG_RETURN_POINTER(email);
 }
 
 PG_FUNCTION_INFO_V1(email_out);
@@ -275,6 +267,7 @@ Datum email_recv(PG_FUNCTION_ARGS)
 	*str = '#';
 	str++;
 	*str = '\0';
+	result->data[EMAIL_PROVIDER_BYTE] = emailFindProvider(domain, strlen(domain));
 	//Now return the result and free the alloc before that
 	pfree(local);
 	pfree(domain);
@@ -304,55 +297,106 @@ Datum email_send(PG_FUNCTION_ARGS)
 
 /*****************************************************************************
  * New Operators
+ *
+ * The comparison and hash functions below work directly on the stored
+ * "local@domain#" string. They never allocate and never raise an error for
+ * a value produced by email_in/email_recv, which is what allows them to be
+ * declared LEAKPROOF, and keeps them small enough for the JIT to inline.
  *****************************************************************************/
+
+//Split a stored value into the length of its local and domain part
+static inline void
+emailSplit(const Email *email, int *localLen, int *domainLen)
+{
+	const char *at = strchr(email->data, '@');
+
+	*localLen = at - email->data;
+	*domainLen = strchr(at, '#') - at - 1;
+}
+
+//Same ordering as strcmp() on the two parts, without copying them out
+static inline int
+emailPartCmp(const char *a, int aLen, const char *b, int bLen)
+{
+	int		result = memcmp(a, b, Min(aLen, bLen));
+
+	if (result == 0)
+		result = aLen - bLen;
+	return (result > 0) - (result < 0);
+}
+
+//Order by domain first and then by local part
+static inline int
+emailCmp(const Email *a, const Email *b)
+{
+	int		aLenghtLocal;
+	int		aLenghtDomain;
+	int		bLenghtLocal;
+	int		bLenghtDomain;
+	int		result;
+
+	emailSplit(a, &aLenghtLocal, &aLenghtDomain);
+	emailSplit(b, &bLenghtLocal, &bLenghtDomain);
+
+	result = emailPartCmp(a->data + aLenghtLocal + 1, aLenghtDomain,
+						  b->data + bLenghtLocal + 1, bLenghtDomain);
+	if (result == 0)
+		result = emailPartCmp(a->data, aLenghtLocal, b->data, bLenghtLocal);
+	return result;
+}
+
+#define EMAIL_PREFIX 64
+
+/*
+ * Both parts are equal exactly when the whole "local@domain#" is equal.
+ * Values are zero padded after the '#' (see Email), so the first 64 bytes
+ * are compared without looking for the '#' first: a constant length memcmp
+ * the compiler turns into a few vector compares. Only when they match and
+ * the address is longer than that is the rest compared up to the '#'.
+ */
+static inline bool
+emailEq(const Email *a, const Email *b)
+{
+	const char *rest = a->data + EMAIL_PREFIX;
+
+	if (memcmp(a->data, b->data, EMAIL_PREFIX) != 0)
+		return false;
+	//The '#' ends both at the same place, the padding after it matched too
+	if (memchr(a->data, '#', EMAIL_PREFIX) != NULL)
+		return true;
+	return memcmp(rest, b->data + EMAIL_PREFIX, strchr(rest, '#') - rest + 1) == 0;
+}
+
+//Return the domain part of a stored "local@domain#" value and its length
+static inline const char *
+emailDomain(const Email *email, int *len)
+{
+	const char *domain = strchr(email->data, '@') + 1;
+
+	*len = strchr(domain, '#') - domain;
+	return domain;
+}
+
+static inline bool
+emailDomainEq(const Email *a, const Email *b)
+{
+	const char *aDomain;
+	const char *bDomain;
+	int		aLenghtDomain;
+	int		bLenghtDomain;
+
+	aDomain = emailDomain(a, &aLenghtDomain);
+	bDomain = emailDomain(b, &bLenghtDomain);
+	return aLenghtDomain == bLenghtDomain && memcmp(aDomain, bDomain, aLenghtDomain) == 0;
+}
+
 PG_FUNCTION_INFO_V1(email_eq); //Email1 = Email2
 Datum email_eq(PG_FUNCTION_ARGS)
 {
-	char* aLocal ;
-	char* bLocal ;
-	char* aDomain ;
-	char* bDomain ;
-	char *delimiter;
-	int aLenghtLocal;
-	int aLenghtDomain;
-	int bLenghtLocal;
-	int bLenghtDomain;
-
 	Email    *a = (Email *) PG_GETARG_POINTER(0);
 	Email    *b = (Email *) PG_GETARG_POINTER(1);
 
-	//Now we need to get the local length of input
-	delimiter = strchr(a->data,'@');
-	aLenghtLocal = delimiter - a->data;
-	delimiter = strchr(b->data,'@');
-	bLenghtLocal = delimiter - b->data;
-	//And next is the domain length	
-	delimiter = strchr(a->data,'#');
-	aLenghtDomain = (int)(delimiter - a->data) - aLenghtLocal -1;
-	delimiter = strchr(b->data,'#');
-	bLenghtDomain = (int)(delimiter - b->data) - bLenghtLocal -1;
-	//We need to get the local and domain of each input
-	aLocal = (char*) palloc0( aLenghtLocal +1);
-	bLocal = (char*) palloc0( bLenghtLocal +1);
-	aDomain = (char*) palloc0( aLenghtDomain +1);
-	bDomain = (char*) palloc0( bLenghtDomain +1);
-	//Get the local		
-	memmove(aLocal,a->data,aLenghtLocal);
-	*(aLocal+aLenghtLocal+1)='t';
-	*(aLocal+aLenghtLocal+2)='\0';
-	memmove(bLocal,b->data,bLenghtLocal);
-	*(bLocal+bLenghtLocal+1)='t';
-	*(bLocal+bLenghtLocal+2)='\0';	
-	//Get the domain
-	memmove(aDomain,a->data + aLenghtLocal + 1,aLenghtDomain);
-	*(aDomain+aLenghtDomain+1)='t';
-	*(aDomain+aLenghtDomain+2)='\0';
-	memmove(bDomain,b->data + bLenghtLocal + 1,bLenghtDomain);
-	*(bDomain+bLenghtDomain+1)='t';
-	*(bDomain+bLenghtDomain+2)='\0';	
-	
-	//Investigate on the boolean value of postgree
-	PG_RETURN_BOOL( (strcmp(aLocal, bLocal) == 0) && (strcmp(aDomain, bDomain) == 0) );
+	PG_RETURN_BOOL(emailEq(a, b));
 }
 
 PG_FUNCTION_INFO_V1(email_not_eq); //Email1 <> Email2
@@ -360,116 +404,19 @@ PG_FUNCTION_INFO_V1(email_not_eq); //Email1 <> Email2
 Datum
 email_not_eq(PG_FUNCTION_ARGS)
 {
-	char* aLocal ;
-	char* bLocal ;
-	char* aDomain ;
-	char* bDomain ;
-	char *delimiter;
-	int aLenghtLocal;
-	int aLenghtDomain;
-	int bLenghtLocal;
-	int bLenghtDomain;
-
 	Email    *a = (Email *) PG_GETARG_POINTER(0);
 	Email    *b = (Email *) PG_GETARG_POINTER(1);
 
-	//Now we need to get the local length of inputresult = 0;
-	delimiter = strchr(a->data,'@');
-	aLenghtLocal = delimiter - a->data;
-	delimiter = strchr(b->data,'@');
-	bLenghtLocal = delimiter - b->data;	
-	//And next is the domain length	
-	delimiter = strchr(a->data,'#');
-	aLenghtDomain = (int)(delimiter - a->data) - aLenghtLocal -1;
-	delimiter = strchr(b->data,'#');
-	bLenghtDomain = (int)(delimiter - b->data) - bLenghtLocal -1;
-	//We need to get the local and domain of each input
-	aLocal = (char*) palloc0( aLenghtLocal +1);
-	bLocal = (char*) palloc0( bLenghtLocal +1);
-	aDomain = (char*) palloc0( aLenghtDomain +1);
-	bDomain = (char*) palloc0( bLenghtDomain +1);
-	//Get the local		
-	memmove(aLocal,a->data,aLenghtLocal);
-	*(aLocal+aLenghtLocal+1)='t';
-	*(aLocal+aLenghtLocal+2)='\0';
-	memmove(bLocal,b->data,bLenghtLocal);
-	*(bLocal+bLenghtLocal+1)='t';
-	*(bLocal+bLenghtLocal+2)='\0';	
-	//Get the domain
-	memmove(aDomain,a->data + aLenghtLocal + 1,aLenghtDomain);
-	*(aDomain+aLenghtDomain+1)='t';
-	*(aDomain+aLenghtDomain+2)='\0';
-	memmove(bDomain,b->data + bLenghtLocal + 1,bLenghtDomain);
-	*(bDomain+bLenghtDomain+1)='t';
-	*(bDomain+bLenghtDomain+2)='\0';		
-		
-	//Investigate on the boolean value of postgree
-	PG_RETURN_BOOL(!((strcmp(aLocal, bLocal) == 0) && (strcmp(aDomain, bDomain) == 0)));
+	PG_RETURN_BOOL(!emailEq(a, b));
 }
 
 PG_FUNCTION_INFO_V1(email_gt); //Email1 > Email2
 Datum email_gt(PG_FUNCTION_ARGS)
 {
-	char* aLocal ;
-	char* bLocal ;
-	char* aDomain ;
-	char* bDomain ;
-	char *delimiter;
-	int aLenghtLocal;
-	int aLenghtDomain;
-	int bLenghtLocal;
-	int bLenghtDomain;
-	int i;	
-
 	Email    *a = (Email *) PG_GETARG_POINTER(0);
 	Email    *b = (Email *) PG_GETARG_POINTER(1);
 
-	//Now we need to get the local length of input
-	delimiter = strchr(a->data,'@');
-	aLenghtLocal = delimiter - a->data;
-	delimiter = strchr(b->data,'@');
-	bLenghtLocal = delimiter - b->data;	
-	//And next is the domain length	
-	delimiter = strchr(a->data,'#');
-	aLenghtDomain = (int)(delimiter - a->data) - aLenghtLocal -1;
-	delimiter = strchr(b->data,'#');
-	bLenghtDomain = (int)(delimiter - b->data) - bLenghtLocal -1;
-	//We need to get the local and domain of each input
-	aLocal = (char*) palloc0( aLenghtLocal +1);
-	bLocal = (char*) palloc0( bLenghtLocal +1);
-	aDomain = (char*) palloc0( aLenghtDomain +1);
-	bDomain = (char*) palloc0( bLenghtDomain +1);
-	//Get the local		
-	memmove(aLocal,a->data,aLenghtLocal);
-	*(aLocal+aLenghtLocal+1)='t';
-	*(aLocal+aLenghtLocal+2)='\0';
-	memmove(bLocal,b->data,bLenghtLocal);
-	*(bLocal+bLenghtLocal+1)='t';
-	*(bLocal+bLenghtLocal+2)='\0';	
-	//Get the domain
-	memmove(aDomain,a->data + aLenghtLocal + 1,aLenghtDomain);
-	*(aDomain+aLenghtDomain+1)='t';
-	*(aDomain+aLenghtDomain+2)='\0';
-	memmove(bDomain,b->data + bLenghtLocal + 1,bLenghtDomain);
-	*(bDomain+bLenghtDomain+1)='t';
-	*(bDomain+bLenghtDomain+2)='\0';		
-
-	//Compare function
-	i = strcmp(aDomain, bDomain);
-	if (i > 0) {
-		PG_RETURN_BOOL(1);
-	}
-	else if (i < 0) {
-		PG_RETURN_BOOL(0);
-	}
-	else {
-		if (strcmp(aLocal, bLocal) > 0) {
-			PG_RETURN_BOOL(1);
-		}
-		else {
-			PG_RETURN_BOOL(0);
-		}
-	}
+	PG_RETURN_BOOL(emailCmp(a, b) > 0);
 }
 
 PG_FUNCTION_INFO_V1(email_gt_eq); //Email1 >= Email2
@@ -477,367 +424,1033 @@ PG_FUNCTION_INFO_V1(email_gt_eq); //Email1 >= Email2
 Datum
 email_gt_eq(PG_FUNCTION_ARGS)
 {
-	char* aLocal ;
-	char* bLocal ;
-	char* aDomain ;
-	char* bDomain ;
-	char *delimiter;	
-	int aLenghtLocal;
-	int aLenghtDomain;
-	int bLenghtLocal;
-	int bLenghtDomain;
-	int i;	
-
 	Email    *a = (Email *) PG_GETARG_POINTER(0);
 	Email    *b = (Email *) PG_GETARG_POINTER(1);
 
-	//Now we need to get the local length of input
-	delimiter = strchr(a->data,'@');
-	aLenghtLocal = delimiter - a->data;
-	delimiter = strchr(b->data,'@');
-	bLenghtLocal = delimiter - b->data;	
-	//And next is the domain length	
-	delimiter = strchr(a->data,'#');
-	aLenghtDomain = (int)(delimiter - a->data) - aLenghtLocal -1;
-	delimiter = strchr(b->data,'#');
-	bLenghtDomain = (int)(delimiter - b->data) - bLenghtLocal -1;
-	//We need to get the local and domain of each input
-	aLocal = (char*) palloc0( aLenghtLocal +1);
-	bLocal = (char*) palloc0( bLenghtLocal +1);
-	aDomain = (char*) palloc0( aLenghtDomain +1);
-	bDomain = (char*) palloc0( bLenghtDomain +1);
-	//Get the local		
-	memmove(aLocal,a->data,aLenghtLocal);
-	*(aLocal+aLenghtLocal+1)='t';
-	*(aLocal+aLenghtLocal+2)='\0';
-	memmove(bLocal,b->data,bLenghtLocal);
-	*(bLocal+bLenghtLocal+1)='t';
-	*(bLocal+bLenghtLocal+2)='\0';	
-	//Get the domain
-	memmove(aDomain,a->data + aLenghtLocal + 1,aLenghtDomain);
-	*(aDomain+aLenghtDomain+1)='t';
-	*(aDomain+aLenghtDomain+2)='\0';
-	memmove(bDomain,b->data + bLenghtLocal + 1,bLenghtDomain);
-	*(bDomain+bLenghtDomain+1)='t';
-	*(bDomain+bLenghtDomain+2)='\0';
-	//Compare function
-	i = strcmp(aDomain, bDomain);
-	if (i > 0) {
-		PG_RETURN_BOOL(1);
-	}
-	else if (i < 0) {
-		PG_RETURN_BOOL(0);
-	}
-	else {
-		if (strcmp(aLocal, bLocal) >= 0) {
-			PG_RETURN_BOOL(1);
-		}
-		else {
-			PG_RETURN_BOOL(0);
-		}
-	}
+	PG_RETURN_BOOL(emailCmp(a, b) >= 0);
 }
 
 PG_FUNCTION_INFO_V1(email_lt); //Email1 < Email2
 Datum
 email_lt(PG_FUNCTION_ARGS)
 {
-	char* aLocal ;
-	char* bLocal ;
-	char* aDomain ;
-	char* bDomain ;
-	char *delimiter;
-	int aLenghtLocal;
-	int aLenghtDomain;
-	int bLenghtLocal;
-	int bLenghtDomain;
-	int i;	
+	Email    *a = (Email *) PG_GETARG_POINTER(0);
+	Email    *b = (Email *) PG_GETARG_POINTER(1);
 
+	PG_RETURN_BOOL(emailCmp(a, b) < 0);
+}
+
+PG_FUNCTION_INFO_V1(email_lt_eq); //Email1 <= Email2
+Datum email_lt_eq(PG_FUNCTION_ARGS)
+{
 	Email    *a = (Email *) PG_GETARG_POINTER(0);
 	Email    *b = (Email *) PG_GETARG_POINTER(1);
 
-	//Now we need to get the local length of input
-	delimiter = strchr(a->data,'@');
-	aLenghtLocal = delimiter - a->data;
-	delimiter = strchr(b->data,'@');
-	bLenghtLocal = delimiter - b->data;	
-	//And next is the domain length	
-	delimiter = strchr(a->data,'#');
-	aLenghtDomain = (int)(delimiter - a->data) - aLenghtLocal -1;
-	delimiter = strchr(b->data,'#');
-	bLenghtDomain = (int)(delimiter - b->data) - bLenghtLocal -1;
-	//We need to get the local and domain of each input
-	aLocal = (char*) palloc0( aLenghtLocal +1);
-	bLocal = (char*) palloc0( bLenghtLocal +1);
-	aDomain = (char*) palloc0( aLenghtDomain +1);
-	bDomain = (char*) palloc0( bLenghtDomain +1);
-	//Get the local		
-	memmove(aLocal,a->data,aLenghtLocal);
-	*(aLocal+aLenghtLocal+1)='t';
-	*(aLocal+aLenghtLocal+2)='\0';
-	memmove(bLocal,b->data,bLenghtLocal);
-	*(bLocal+bLenghtLocal+1)='t';
-	*(bLocal+bLenghtLocal+2)='\0';	
-	//Get the domain
-	memmove(aDomain,a->data + aLenghtLocal + 1,aLenghtDomain);
-	*(aDomain+aLenghtDomain+1)='t';
-	*(aDomain+aLenghtDomain+2)='\0';
-	memmove(bDomain,b->data + bLenghtLocal + 1,bLenghtDomain);
-	*(bDomain+bLenghtDomain+1)='t';
-	*(bDomain+bLenghtDomain+2)='\0';
-
-	i = strcmp(aDomain, bDomain);
-	if (i < 0) {
-		PG_RETURN_BOOL(1);
-	}
-	else if (i > 0) {
-		PG_RETURN_BOOL(0);
+	PG_RETURN_BOOL(emailCmp(a, b) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(email_domain_eq); //Email1 ~ Email2
+Datum email_domain_eq(PG_FUNCTION_ARGS)
+{
+	Email    *a = (Email *) PG_GETARG_POINTER(0);
+	Email    *b = (Email *) PG_GETARG_POINTER(1);
+
+	PG_RETURN_BOOL(emailDomainEq(a, b));
+}
+
+PG_FUNCTION_INFO_V1(email_not_domain_eq); //Email1 !~ Email2
+Datum email_not_domain_eq(PG_FUNCTION_ARGS)
+{
+	Email    *a = (Email *) PG_GETARG_POINTER(0);
+	Email    *b = (Email *) PG_GETARG_POINTER(1);
+
+	PG_RETURN_BOOL(!emailDomainEq(a, b));
+}
+
+
+
+PG_FUNCTION_INFO_V1(email_cmp);
+Datum email_cmp(PG_FUNCTION_ARGS)
+{
+	Email    *a = (Email *) PG_GETARG_POINTER(0);
+	Email    *b = (Email *) PG_GETARG_POINTER(1);
+
+	PG_RETURN_INT32(emailCmp(a, b));
+}
+
+
+PG_FUNCTION_INFO_V1(email_hash);
+Datum
+email_hash(PG_FUNCTION_ARGS)
+{
+	//Hash "local@domain" in place, the '#' terminator is not part of it
+	Email *email = (Email *) PG_GETARG_POINTER(0);
+	int len = strchr(email->data, '#') - email->data;
+
+	PG_RETURN_DATUM(hash_any((unsigned char *) email->data, len));
+}
+
+PG_FUNCTION_INFO_V1(email_domain);
+Datum
+email_domain(PG_FUNCTION_ARGS)
+{
+	//Two values have the same email_domain() exactly when they are ~
+	Email    *email = (Email *) PG_GETARG_POINTER(0);
+	const char *domain;
+	int		len;
+
+	domain = emailDomain(email, &len);
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(domain, len));
+}
+
+/*****************************************************************************
+ * Domain set membership
+ *****************************************************************************/
+
+/*
+ * Open addressing hash set of the domains in a text[] argument.
+ * The number of buckets is a power of 2 and at least twice the number of
+ * domains, so a probe stops at an empty bucket after a few steps.
+ */
+typedef struct DomainSet
+{
+	MemoryContext cxt;		/* holds the set and everything below */
+	ArrayType  *array;		/* the list it was built from, NULL if constant */
+	int		mask;
+	uint32 *hashes;
+	int	   *lengths;
+	char  **domains;	/* NULL marks an empty bucket */
+}	DomainSet;
+
+static DomainSet *
+domainSetBuild(ArrayType *array, bool keepArray, MemoryContext parent)
+{
+	MemoryContext cxt = AllocSetContextCreate(parent, "email domain set",
+											  ALLOCSET_DEFAULT_SIZES);
+	MemoryContext oldcxt = MemoryContextSwitchTo(cxt);
+	DomainSet *set;
+	Datum  *elems;
+	bool   *nulls;
+	int		nelems;
+	int		nbuckets;
+	int		i;
+
+	deconstruct_array(array, TEXTOID, -1, false, 'i', &elems, &nulls, &nelems);
+
+	nbuckets = 8;
+	while (nbuckets < nelems * 2)
+		nbuckets *= 2;
+
+	set = (DomainSet *) palloc0(sizeof(DomainSet));
+	set->cxt = cxt;
+	if (keepArray) {
+		set->array = (ArrayType *) palloc(VARSIZE(array));
+		memcpy(set->array, array, VARSIZE(array));
 	}
-	else {
-		if (strcmp(aLocal, bLocal) < 0) {
-			PG_RETURN_BOOL(1);
+	set->mask = nbuckets - 1;
+	set->hashes = (uint32 *) palloc0(nbuckets * sizeof(uint32));
+	set->lengths = (int *) palloc0(nbuckets * sizeof(int));
+	set->domains = (char **) palloc0(nbuckets * sizeof(char *));
+
+	for (i = 0; i < nelems; i++) {
+		text   *t;
+		char   *domain;
+		int		len;
+		int		j;
+		uint32	hash;
+		int		slot;
+
+		//NULL elements can never match a domain, just skip them
+		if (nulls[i])
+			continue;
+
+		//Stored domains are lower case, so fold the list the same way
+		t = (text *) PG_DETOAST_DATUM(elems[i]);
+		len = VARSIZE_ANY_EXHDR(t);
+		domain = (char *) palloc(len + 1);
+		for (j = 0; j < len; j++)
+			domain[j] = tolower((unsigned char) VARDATA_ANY(t)[j]);
+		domain[len] = '\0';
+
+		hash = DatumGetUInt32(hash_any((unsigned char *) domain, len));
+		slot = hash & set->mask;
+		while (set->domains[slot] != NULL) {
+			if (set->hashes[slot] == hash && set->lengths[slot] == len &&
+				memcmp(set->domains[slot], domain, len) == 0)
+				break;
+			slot = (slot + 1) & set->mask;
 		}
-		else {
-			PG_RETURN_BOOL(0);
+		if (set->domains[slot] == NULL) {
+			set->hashes[slot] = hash;
+			set->lengths[slot] = len;
+			set->domains[slot] = domain;
 		}
 	}
+
+	pfree(elems);
+	pfree(nulls);
+	MemoryContextSwitchTo(oldcxt);
+	return set;
 }
 
-PG_FUNCTION_INFO_V1(email_lt_eq); //Email1 <= Email2
-Datum email_lt_eq(PG_FUNCTION_ARGS)
+static bool
+domainSetContains(DomainSet *set, const char *domain, int len)
 {
-	char* aLocal ;
-	char* bLocal ;
-	char* aDomain ;
-	char* bDomain ;
-	char *delimiter;
-	
-	int aLenghtLocal;
-	int aLenghtDomain;
-	int bLenghtLocal;
-	int bLenghtDomain;
-	int i;	
+	uint32	hash = DatumGetUInt32(hash_any((const unsigned char *) domain, len));
+	int		slot = hash & set->mask;
+
+	while (set->domains[slot] != NULL) {
+		if (set->hashes[slot] == hash && set->lengths[slot] == len &&
+			memcmp(set->domains[slot], domain, len) == 0)
+			return true;
+		slot = (slot + 1) & set->mask;
+	}
+	return false;
+}
+
+PG_FUNCTION_INFO_V1(email_domain_in_set); //Email <@ text[]
+Datum
+email_domain_in_set(PG_FUNCTION_ARGS)
+{
+	Email    *email = (Email *) PG_GETARG_POINTER(0);
+	ArrayType *array = PG_GETARG_ARRAYTYPE_P(1);
+	DomainSet *set = (DomainSet *) fcinfo->flinfo->fn_extra;
+	const char *domain;
+	int		len;
+
+	//The set is kept in fn_extra. A constant list never changes, anything
+	//else (e.g. ARRAY(SELECT ...) from an initplan) is reused for as long as
+	//the incoming array is byte-identical to the one it was built from
+	if (set != NULL && set->array != NULL &&
+		(VARSIZE(set->array) != VARSIZE(array) ||
+		 memcmp(set->array, array, VARSIZE(array)) != 0)) {
+		MemoryContextDelete(set->cxt);
+		set = NULL;
+	}
+	if (set == NULL) {
+		set = domainSetBuild(array, !get_fn_expr_arg_stable(fcinfo->flinfo, 1),
+							 fcinfo->flinfo->fn_mcxt);
+		fcinfo->flinfo->fn_extra = set;
+	}
+
+	domain = emailDomain(email, &len);
+	PG_RETURN_BOOL(domainSetContains(set, domain, len));
+}
+
+/*****************************************************************************
+ * EmailFingerprint: 8 byte fingerprint of an EmailAddress
+ *
+ * The fingerprint is a 64-bit hash of "local@domain", so equal addresses
+ * always have equal fingerprints but two different addresses can collide.
+ * It is meant to be carried through joins and sorts in place of the 260 byte
+ * value, with the final match checked against the original addresses.
+ *****************************************************************************/
+
+#define FINGERPRINT_DIGITS 16
+
+static const char fingerprintHex[] = "0123456789abcdef";
+
+PG_FUNCTION_INFO_V1(email_fingerprint);
+Datum
+email_fingerprint(PG_FUNCTION_ARGS)
+{
+	Email    *email = (Email *) PG_GETARG_POINTER(0);
+	int		len = strchr(email->data, '#') - email->data;
+
+	PG_RETURN_INT64((int64) DatumGetUInt64(hash_any_extended((unsigned char *) email->data, len, 0)));
+}
+
+PG_FUNCTION_INFO_V1(fingerprint_in);
+Datum
+fingerprint_in(PG_FUNCTION_ARGS)
+{
+	//Text form is always 16 lower case hex digits
+	char   *in = PG_GETARG_CSTRING(0);
+	uint64	result;
+	int		i;
+
+	result = 0;
+	for (i = 0; i < FINGERPRINT_DIGITS; i++) {
+		char   *digit;
+
+		if (in[i] == '\0' || (digit = strchr(fingerprintHex, tolower((unsigned char) in[i]))) == NULL) {
+			ereport(ERROR,
+			(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+			 errmsg("Error: A fingerprint must be 16 hexadecimal digits")));
+		}
+		result = (result << 4) | (digit - fingerprintHex);
+	}
+	if (in[i] != '\0') {
+		ereport(ERROR,
+		(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+		 errmsg("Error: A fingerprint must be 16 hexadecimal digits")));
+	}
+
+	PG_RETURN_INT64((int64) result);
+}
+
+PG_FUNCTION_INFO_V1(fingerprint_out);
+Datum
+fingerprint_out(PG_FUNCTION_ARGS)
+{
+	uint64	fp = (uint64) PG_GETARG_INT64(0);
+	char   *result = (char *) palloc(FINGERPRINT_DIGITS + 1);
+	int		i;
+
+	for (i = FINGERPRINT_DIGITS - 1; i >= 0; i--) {
+		result[i] = fingerprintHex[fp & 0xf];
+		fp >>= 4;
+	}
+	result[FINGERPRINT_DIGITS] = '\0';
+	PG_RETURN_CSTRING(result);
+}
+
+PG_FUNCTION_INFO_V1(fingerprint_recv);
+Datum
+fingerprint_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+
+	PG_RETURN_INT64(pq_getmsgint64(buf));
+}
+
+PG_FUNCTION_INFO_V1(fingerprint_send);
+Datum
+fingerprint_send(PG_FUNCTION_ARGS)
+{
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+	pq_sendint64(&buf, PG_GETARG_INT64(0));
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+//Fingerprints sort as unsigned numbers, which is also their text order
+#define FINGERPRINT_ARGS \
+	uint64	a = (uint64) PG_GETARG_INT64(0); \
+	uint64	b = (uint64) PG_GETARG_INT64(1)
 
+PG_FUNCTION_INFO_V1(fingerprint_eq);
+Datum
+fingerprint_eq(PG_FUNCTION_ARGS)
+{
+	FINGERPRINT_ARGS;
+
+	PG_RETURN_BOOL(a == b);
+}
+
+PG_FUNCTION_INFO_V1(fingerprint_not_eq);
+Datum
+fingerprint_not_eq(PG_FUNCTION_ARGS)
+{
+	FINGERPRINT_ARGS;
+
+	PG_RETURN_BOOL(a != b);
+}
+
+PG_FUNCTION_INFO_V1(fingerprint_lt);
+Datum
+fingerprint_lt(PG_FUNCTION_ARGS)
+{
+	FINGERPRINT_ARGS;
+
+	PG_RETURN_BOOL(a < b);
+}
+
+PG_FUNCTION_INFO_V1(fingerprint_lt_eq);
+Datum
+fingerprint_lt_eq(PG_FUNCTION_ARGS)
+{
+	FINGERPRINT_ARGS;
+
+	PG_RETURN_BOOL(a <= b);
+}
+
+PG_FUNCTION_INFO_V1(fingerprint_gt);
+Datum
+fingerprint_gt(PG_FUNCTION_ARGS)
+{
+	FINGERPRINT_ARGS;
+
+	PG_RETURN_BOOL(a > b);
+}
+
+PG_FUNCTION_INFO_V1(fingerprint_gt_eq);
+Datum
+fingerprint_gt_eq(PG_FUNCTION_ARGS)
+{
+	FINGERPRINT_ARGS;
+
+	PG_RETURN_BOOL(a >= b);
+}
+
+PG_FUNCTION_INFO_V1(fingerprint_cmp);
+Datum
+fingerprint_cmp(PG_FUNCTION_ARGS)
+{
+	FINGERPRINT_ARGS;
+
+	PG_RETURN_INT32((a > b) - (a < b));
+}
+
+PG_FUNCTION_INFO_V1(fingerprint_hash);
+Datum
+fingerprint_hash(PG_FUNCTION_ARGS)
+{
+	//The fingerprint is already a hash, so fold it down to 32 bits
+	uint64	fp = (uint64) PG_GETARG_INT64(0);
+
+	PG_RETURN_INT32((int32) (uint32) (fp ^ (fp >> 32)));
+}
+
+/*****************************************************************************
+ * Edit distance and GiST support for nearest neighbour searches
+ *
+ * email1 <-> email2 is the Levenshtein distance between the two
+ * "local@domain" strings. The GiST key does not store the address itself
+ * but how often each allowed character occurs in it. An inner key is the
+ * per character [min, max] range of everything below it, plus the range of
+ * lengths. Every edit changes one count by one (insert/delete) or two counts
+ * by one each (substitute), so the counts give a lower bound of the edit
+ * distance that GiST can use to order the search. The exact distance is
+ * rechecked on the heap tuple.
+ *
+ * Counts alone cannot tell "jon@gmial.com" from "jon@gmail.com", so the key
+ * also carries a 128 bit signature of the bigrams of "^local@domain$" (an
+ * inner key ORs those of its children). One edit creates at most two
+ * bigrams and destroys at most two, so every two query bigrams missing from
+ * the key cost at least one edit, and on a leaf so do every two address
+ * bigrams missing from the query.
+ *****************************************************************************/
+
+#define EMAIL_SYMBOLS 38	/* a-z, 0-9, '.' and '-' */
+#define EMAIL_BIGRAM_WORDS 2
+#define EMAIL_GIST_EQ_STRATEGY 1
+#define EMAIL_GIST_DISTANCE_STRATEGY 15
+
+typedef struct EmailGistKey
+{
+	uint16	minLen;
+	uint16	maxLen;
+	uint8	lo[EMAIL_SYMBOLS];	/* counts are capped at 255 */
+	uint8	hi[EMAIL_SYMBOLS];
+	uint64	bigrams[EMAIL_BIGRAM_WORDS];	/* set bits, hashed mod 128 */
+}	EmailGistKey;
+
+//Map an address character to its slot in the count vector
+static inline int
+emailSymbol(char c)
+{
+	if (c >= 'a' && c <= 'z')
+		return c - 'a';
+	if (c >= '0' && c <= '9')
+		return 26 + c - '0';
+	if (c == '.')
+		return 36;
+	if (c == '-')
+		return 37;
+	return -1;	/* '@', same count in every address */
+}
+
+//Set the signature bit of the bigram (a, b), -1 stands for the start or end
+static inline void
+emailBigramAdd(EmailGistKey *key, int a, int b)
+{
+	uint32	bit = ((uint32) ((a + 1) * (EMAIL_SYMBOLS + 2) + b + 1) * 2654435761U) >> 25;
+
+	key->bigrams[bit >> 6] |= UINT64CONST(1) << (bit & 63);
+}
+
+//Number of signature bits set in a but not in b
+static inline int
+emailBigramsMissing(const EmailGistKey *a, const EmailGistKey *b)
+{
+	int		missing = 0;
+	int		i;
+
+	for (i = 0; i < EMAIL_BIGRAM_WORDS; i++)
+		missing += pg_popcount64(a->bigrams[i] & ~b->bigrams[i]);
+	return missing;
+}
+
+static void
+emailGistKeyFromEmail(const Email *email, EmailGistKey *key)
+{
+	int		counts[EMAIL_SYMBOLS];
+	const char *str;
+	int		prev = -1;
+	int		i;
+
+	memset(counts, 0, sizeof(counts));
+	memset(key->bigrams, 0, sizeof(key->bigrams));
+	for (str = email->data; *str != '#'; str++) {
+		int		sym = emailSymbol(*str);
+
+		if (sym >= 0)
+			counts[sym]++;
+		else
+			sym = EMAIL_SYMBOLS;	/* '@' still counts for bigrams */
+		emailBigramAdd(key, prev, sym);
+		prev = sym;
+	}
+	emailBigramAdd(key, prev, -1);
+	key->minLen = key->maxLen = str - email->data;
+	for (i = 0; i < EMAIL_SYMBOLS; i++)
+		key->lo[i] = key->hi[i] = Min(counts[i], 255);
+}
+
+//Grow key so that it also covers other
+static void
+emailGistKeyExtend(EmailGistKey *key, const EmailGistKey *other)
+{
+	int		i;
+
+	key->minLen = Min(key->minLen, other->minLen);
+	key->maxLen = Max(key->maxLen, other->maxLen);
+	for (i = 0; i < EMAIL_SYMBOLS; i++) {
+		key->lo[i] = Min(key->lo[i], other->lo[i]);
+		key->hi[i] = Max(key->hi[i], other->hi[i]);
+	}
+	for (i = 0; i < EMAIL_BIGRAM_WORDS; i++)
+		key->bigrams[i] |= other->bigrams[i];
+}
+
+//Total width of all ranges in the key, used as its "size"
+static int
+emailGistKeySize(const EmailGistKey *key)
+{
+	int		size = key->maxLen - key->minLen;
+	int		i;
+
+	for (i = 0; i < EMAIL_SYMBOLS; i++)
+		size += key->hi[i] - key->lo[i];
+	for (i = 0; i < EMAIL_BIGRAM_WORDS; i++)
+		size += pg_popcount64(key->bigrams[i]);
+	return size;
+}
+
+//How much key has to grow to also cover other
+static int
+emailGistKeyGrowth(const EmailGistKey *key, const EmailGistKey *other)
+{
+	EmailGistKey merged = *key;
+
+	emailGistKeyExtend(&merged, other);
+	return emailGistKeySize(&merged) - emailGistKeySize(key);
+}
+
+/*
+ * Lower bound of the edit distance between query and any address inside
+ * key. Characters the address has more of than the query must be deleted or
+ * substituted, characters it has fewer of must be inserted or substituted,
+ * and one edit fixes at most one of each. The bigram bound is described at
+ * the top of this section, its reverse direction only holds for a leaf.
+ */
+static int
+emailGistLowerBound(const EmailGistKey *key, const EmailGistKey *query, bool leaf)
+{
+	int		surplus = 0;
+	int		missing = 0;
+	int		bound = 0;
+	int		i;
+
+	for (i = 0; i < EMAIL_SYMBOLS; i++) {
+		if (key->lo[i] > query->lo[i])
+			surplus += key->lo[i] - query->lo[i];
+		else if (key->hi[i] < query->lo[i])
+			missing += query->lo[i] - key->hi[i];
+	}
+	if (key->minLen > query->minLen)
+		bound = key->minLen - query->minLen;
+	else if (key->maxLen < query->minLen)
+		bound = query->minLen - key->maxLen;
+	bound = Max(bound, Max(surplus, missing));
+
+	bound = Max(bound, (emailBigramsMissing(query, key) + 1) / 2);
+	if (leaf)
+		bound = Max(bound, (emailBigramsMissing(key, query) + 1) / 2);
+	return bound;
+}
+
+//Levenshtein distance with two rows on the stack, "local@domain" is at most 257 long
+static int
+emailEditDistance(const char *a, int aLen, const char *b, int bLen)
+{
+	int		rows[2][260];
+	int	   *prev = rows[0];
+	int	   *cur = rows[1];
+	int		i;
+	int		j;
+
+	for (j = 0; j <= bLen; j++)
+		prev[j] = j;
+	for (i = 1; i <= aLen; i++) {
+		int	   *tmp;
+
+		cur[0] = i;
+		for (j = 1; j <= bLen; j++) {
+			int		best = prev[j - 1] + (a[i - 1] != b[j - 1]);
+
+			best = Min(best, prev[j] + 1);
+			best = Min(best, cur[j - 1] + 1);
+			cur[j] = best;
+		}
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+	return prev[bLen];
+}
+
+PG_FUNCTION_INFO_V1(email_distance); //Email1 <-> Email2
+Datum
+email_distance(PG_FUNCTION_ARGS)
+{
 	Email    *a = (Email *) PG_GETARG_POINTER(0);
 	Email    *b = (Email *) PG_GETARG_POINTER(1);
+	int		aLen = strchr(a->data, '#') - a->data;
+	int		bLen = strchr(b->data, '#') - b->data;
+
+	PG_RETURN_FLOAT8((float8) emailEditDistance(a->data, aLen, b->data, bLen));
+}
 
-	//Now we need to get the local length of input
-	delimiter = strchr(a->data,'@');
-	aLenghtLocal = delimiter - a->data;
-	delimiter = strchr(b->data,'@');
-	bLenghtLocal = delimiter - b->data;	
-	//And next is the domain length	
-	delimiter = strchr(a->data,'#');
-	aLenghtDomain = (int)(delimiter - a->data) - aLenghtLocal -1;
-	delimiter = strchr(b->data,'#');
-	bLenghtDomain = (int)(delimiter - b->data) - bLenghtLocal -1;
-	//We need to get the local and domain of each input
-	aLocal = (char*) palloc0( aLenghtLocal +1);
-	bLocal = (char*) palloc0( bLenghtLocal +1);
-	aDomain = (char*) palloc0( aLenghtDomain +1);
-	bDomain = (char*) palloc0( bLenghtDomain +1);
-	//Get the local		
-	memmove(aLocal,a->data,aLenghtLocal);
-	*(aLocal+aLenghtLocal+1)='t';
-	*(aLocal+aLenghtLocal+2)='\0';
-	memmove(bLocal,b->data,bLenghtLocal);
-	*(bLocal+bLenghtLocal+1)='t';
-	*(bLocal+bLenghtLocal+2)='\0';	
-	//Get the domain
-	memmove(aDomain,a->data + aLenghtLocal + 1,aLenghtDomain);
-	*(aDomain+aLenghtDomain+1)='t';
-	*(aDomain+aLenghtDomain+2)='\0';
-	memmove(bDomain,b->data + bLenghtLocal + 1,bLenghtDomain);
-	*(bDomain+bLenghtDomain+1)='t';
-	*(bDomain+bLenghtDomain+2)='\0';	
-
-	//Compare function	
-	i = strcmp(aDomain, bDomain);
-	if (i < 0) {
-		PG_RETURN_BOOL(1);
+//The key type only exists to be stored in the index
+PG_FUNCTION_INFO_V1(email_gist_key_in);
+Datum
+email_gist_key_in(PG_FUNCTION_ARGS)
+{
+	ereport(ERROR,
+	(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+	 errmsg("Error: email_gist_key_in is not implemented")));
+	PG_RETURN_POINTER(NULL);
+}
+
+PG_FUNCTION_INFO_V1(email_gist_key_out);
+Datum
+email_gist_key_out(PG_FUNCTION_ARGS)
+{
+	ereport(ERROR,
+	(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+	 errmsg("Error: email_gist_key_out is not implemented")));
+	PG_RETURN_POINTER(NULL);
+}
+
+PG_FUNCTION_INFO_V1(email_gist_consistent);
+Datum
+email_gist_consistent(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	Email    *query = (Email *) PG_GETARG_POINTER(1);
+	StrategyNumber strategy = (StrategyNumber) PG_GETARG_UINT16(2);
+	bool	   *recheck = (bool *) PG_GETARG_POINTER(4);
+	EmailGistKey *key = (EmailGistKey *) DatumGetPointer(entry->key);
+	EmailGistKey queryKey;
+
+	//Equal counts do not mean equal addresses
+	*recheck = true;
+
+	if (strategy != EMAIL_GIST_EQ_STRATEGY) {
+		ereport(ERROR,
+		(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		 errmsg("Error: Unrecognized strategy number %d", strategy)));
 	}
-	else if (i > 0) {
-		PG_RETURN_BOOL(0);
+
+	emailGistKeyFromEmail(query, &queryKey);
+	PG_RETURN_BOOL(emailGistLowerBound(key, &queryKey, GIST_LEAF(entry)) == 0);
+}
+
+PG_FUNCTION_INFO_V1(email_gist_union);
+Datum
+email_gist_union(PG_FUNCTION_ARGS)
+{
+	GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+	int		   *size = (int *) PG_GETARG_POINTER(1);
+	EmailGistKey *result = (EmailGistKey *) palloc(sizeof(EmailGistKey));
+	int		i;
+
+	*result = *(EmailGistKey *) DatumGetPointer(entryvec->vector[0].key);
+	for (i = 1; i < entryvec->n; i++)
+		emailGistKeyExtend(result, (EmailGistKey *) DatumGetPointer(entryvec->vector[i].key));
+
+	*size = sizeof(EmailGistKey);
+	PG_RETURN_POINTER(result);
+}
+
+PG_FUNCTION_INFO_V1(email_gist_compress);
+Datum
+email_gist_compress(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	GISTENTRY  *retval;
+	EmailGistKey *key;
+
+	//Inner entries are already keys, only leaf addresses need converting
+	if (!entry->leafkey)
+		PG_RETURN_POINTER(entry);
+
+	key = (EmailGistKey *) palloc(sizeof(EmailGistKey));
+	emailGistKeyFromEmail((Email *) DatumGetPointer(entry->key), key);
+
+	retval = (GISTENTRY *) palloc(sizeof(GISTENTRY));
+	gistentryinit(*retval, PointerGetDatum(key),
+				  entry->rel, entry->page, entry->offset, false);
+	PG_RETURN_POINTER(retval);
+}
+
+PG_FUNCTION_INFO_V1(email_gist_decompress);
+Datum
+email_gist_decompress(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+}
+
+PG_FUNCTION_INFO_V1(email_gist_penalty);
+Datum
+email_gist_penalty(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *origentry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	GISTENTRY  *newentry = (GISTENTRY *) PG_GETARG_POINTER(1);
+	float	   *penalty = (float *) PG_GETARG_POINTER(2);
+
+	*penalty = (float) emailGistKeyGrowth((EmailGistKey *) DatumGetPointer(origentry->key),
+										  (EmailGistKey *) DatumGetPointer(newentry->key));
+	PG_RETURN_POINTER(penalty);
+}
+
+/*
+ * Seed the two pages with the pair of keys that are furthest apart, then
+ * put every other key on the page whose key has to grow the least.
+ */
+PG_FUNCTION_INFO_V1(email_gist_picksplit);
+Datum
+email_gist_picksplit(PG_FUNCTION_ARGS)
+{
+	GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+	GIST_SPLITVEC *v = (GIST_SPLITVEC *) PG_GETARG_POINTER(1);
+	OffsetNumber maxoff = entryvec->n - 1;
+	OffsetNumber i;
+	OffsetNumber j;
+	OffsetNumber seedLeft = FirstOffsetNumber;
+	OffsetNumber seedRight = FirstOffsetNumber + 1;
+	int		worst = -1;
+	EmailGistKey *left;
+	EmailGistKey *right;
+
+	v->spl_left = (OffsetNumber *) palloc((maxoff + 1) * sizeof(OffsetNumber));
+	v->spl_right = (OffsetNumber *) palloc((maxoff + 1) * sizeof(OffsetNumber));
+	v->spl_nleft = 0;
+	v->spl_nright = 0;
+
+	for (i = FirstOffsetNumber; i < maxoff; i = OffsetNumberNext(i)) {
+		EmailGistKey *a = (EmailGistKey *) DatumGetPointer(entryvec->vector[i].key);
+
+		for (j = OffsetNumberNext(i); j <= maxoff; j = OffsetNumberNext(j)) {
+			EmailGistKey *b = (EmailGistKey *) DatumGetPointer(entryvec->vector[j].key);
+			int		waste = emailGistKeyGrowth(a, b) + emailGistKeyGrowth(b, a);
+
+			if (waste > worst) {
+				worst = waste;
+				seedLeft = i;
+				seedRight = j;
+			}
+		}
 	}
-	else {
-		if (strcmp(aLocal, bLocal) <= 0) {
-			PG_RETURN_BOOL(1);
+
+	left = (EmailGistKey *) palloc(sizeof(EmailGistKey));
+	right = (EmailGistKey *) palloc(sizeof(EmailGistKey));
+	*left = *(EmailGistKey *) DatumGetPointer(entryvec->vector[seedLeft].key);
+	*right = *(EmailGistKey *) DatumGetPointer(entryvec->vector[seedRight].key);
+
+	for (i = FirstOffsetNumber; i <= maxoff; i = OffsetNumberNext(i)) {
+		EmailGistKey *key = (EmailGistKey *) DatumGetPointer(entryvec->vector[i].key);
+		int		growLeft;
+		int		growRight;
+
+		if (i == seedLeft) {
+			v->spl_left[v->spl_nleft++] = i;
+			continue;
+		}
+		if (i == seedRight) {
+			v->spl_right[v->spl_nright++] = i;
+			continue;
+		}
+
+		growLeft = emailGistKeyGrowth(left, key);
+		growRight = emailGistKeyGrowth(right, key);
+		if (growLeft < growRight ||
+			(growLeft == growRight && v->spl_nleft <= v->spl_nright)) {
+			emailGistKeyExtend(left, key);
+			v->spl_left[v->spl_nleft++] = i;
 		}
 		else {
-			PG_RETURN_BOOL(0);
+			emailGistKeyExtend(right, key);
+			v->spl_right[v->spl_nright++] = i;
 		}
 	}
+
+	v->spl_ldatum = PointerGetDatum(left);
+	v->spl_rdatum = PointerGetDatum(right);
+	PG_RETURN_POINTER(v);
 }
 
-PG_FUNCTION_INFO_V1(email_domain_eq); //Email1 ~ Email2
-Datum email_domain_eq(PG_FUNCTION_ARGS)
+PG_FUNCTION_INFO_V1(email_gist_same);
+Datum
+email_gist_same(PG_FUNCTION_ARGS)
 {
-	char* aDomain ;
-	char* bDomain ;
-	char *delimiter;
-	
-	int aLenghtLocal;
-	int aLenghtDomain;
-	int bLenghtLocal;
-	int bLenghtDomain;
+	EmailGistKey *a = (EmailGistKey *) PG_GETARG_POINTER(0);
+	EmailGistKey *b = (EmailGistKey *) PG_GETARG_POINTER(1);
+	bool	   *result = (bool *) PG_GETARG_POINTER(2);
 
-	Email    *a = (Email *) PG_GETARG_POINTER(0);
-	Email    *b = (Email *) PG_GETARG_POINTER(1);
+	*result = memcmp(a, b, sizeof(EmailGistKey)) == 0;
+	PG_RETURN_POINTER(result);
+}
 
-	//Now we need to get the local length of input
-	delimiter = strchr(a->data,'@');
-	aLenghtLocal = delimiter - a->data;
-	delimiter = strchr(b->data,'@');
-	bLenghtLocal = delimiter - b->data;
-	//And next is the domain length	
-	delimiter = strchr(a->data,'#');
-	aLenghtDomain = (int)(delimiter - a->data) - aLenghtLocal -1;
-	delimiter = strchr(b->data,'#');
-	bLenghtDomain = (int)(delimiter - b->data) - bLenghtLocal -1;	
-	
-	aDomain = (char*) palloc0( strlen(a->data) - (aLenghtLocal +1) +1);
-	bDomain = (char*) palloc0( strlen(b->data) - (bLenghtLocal +1) +1);
-	//Get the domain
-	memmove(aDomain,a->data + aLenghtLocal + 1,aLenghtDomain);
-	*(aDomain+aLenghtDomain+1)='t';
-	*(aDomain+aLenghtDomain+2)='\0';
-	memmove(bDomain,b->data + bLenghtLocal + 1,bLenghtDomain);
-	*(bDomain+bLenghtDomain+1)='t';
-	*(bDomain+bLenghtDomain+2)='\0';
+PG_FUNCTION_INFO_V1(email_gist_distance);
+Datum
+email_gist_distance(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	Email    *query = (Email *) PG_GETARG_POINTER(1);
+	StrategyNumber strategy = (StrategyNumber) PG_GETARG_UINT16(2);
+	bool	   *recheck = (bool *) PG_GETARG_POINTER(4);
+	EmailGistKey queryKey;
+
+	if (strategy != EMAIL_GIST_DISTANCE_STRATEGY) {
+		ereport(ERROR,
+		(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		 errmsg("Error: Unrecognized strategy number %d", strategy)));
+	}
 
-	PG_RETURN_BOOL(strcmp(aDomain, bDomain) == 0);
+	//Leaf keys only give a lower bound too, the executor computes the real distance
+	*recheck = true;
+
+	emailGistKeyFromEmail(query, &queryKey);
+	PG_RETURN_FLOAT8((float8) emailGistLowerBound((EmailGistKey *) DatumGetPointer(entry->key),
+												  &queryKey, GIST_LEAF(entry)));
 }
 
-PG_FUNCTION_INFO_V1(email_not_domain_eq); //Email1 !~ Email2
-Datum email_not_domain_eq(PG_FUNCTION_ARGS)
+/*****************************************************************************
+ * Canonical equivalence
+ *
+ * Some providers deliver mail for several spellings of one mailbox. The
+ * canonical form folds those spellings together, so the *= family of
+ * operators and the email_canon_ops opclasses can deduplicate by mailbox.
+ * Subaddress tags like "user+tag" cannot occur here, email_in rejects '+'.
+ *****************************************************************************/
+
+//The provider recorded by emailParse(), looked up for values stored before that
+static inline const EmailProvider *
+emailProviderOf(const Email *email, const char *domain, int domainLen)
 {
-	char* aDomain ;
-	char* bDomain ;
-	char *delimiter;
-	
-	int aLenghtLocal;
-	int aLenghtDomain;
-	int bLenghtLocal;
-	int bLenghtDomain;
+	int		provider = (unsigned char) email->data[EMAIL_PROVIDER_BYTE];
+
+	if (provider == EMAIL_PROVIDER_UNKNOWN)
+		provider = emailFindProvider(domain, domainLen);
+	if (provider == EMAIL_PROVIDER_NONE)
+		return NULL;
+	return &emailProviders[provider - EMAIL_PROVIDER_FIRST];
+}
 
+/*
+ * Write the canonical form of email into result. Only the "local@domain#"
+ * string is written, which is all the comparison and hash functions read.
+ * Returns the length of "local@domain".
+ */
+static int
+emailCanonicalize(const Email *email, Email *result)
+{
+	const char *domain;
+	const char *str;
+	char	   *out;
+	int		localLen;
+	int		domainLen;
+	const EmailProvider *provider;
+
+	emailSplit(email, &localLen, &domainLen);
+	domain = email->data + localLen + 1;
+	provider = emailProviderOf(email, domain, domainLen);
+
+	out = result->data;
+	for (str = email->data; str < domain - 1; str++) {
+		if (*str == '.' && provider != NULL && provider->ignoreDots)
+			continue;
+		*out++ = *str;
+	}
+	*out++ = '@';
+	if (provider != NULL) {
+		domainLen = provider->canonicalDomainLen;
+		domain = provider->canonicalDomain;
+	}
+	memcpy(out, domain, domainLen);
+	out += domainLen;
+	*out = '#';
+	return out - result->data;
+}
+
+PG_FUNCTION_INFO_V1(email_canonical);
+Datum
+email_canonical(PG_FUNCTION_ARGS)
+{
+	Email    *email = (Email *) PG_GETARG_POINTER(0);
+	Email    *result = (Email *) palloc0(sizeof(Email));
+	const char *domain;
+	int		len;
+
+	emailCanonicalize(email, result);
+	domain = emailDomain(result, &len);
+	result->data[EMAIL_PROVIDER_BYTE] = emailFindProvider(domain, len);
+	PG_RETURN_POINTER(result);
+}
+
+//strcmp() order of the two local parts, with dots dropped where the provider ignores them
+static inline int
+emailLocalCanonCmp(const char *a, int aLen, bool aSkipDots,
+				   const char *b, int bLen, bool bSkipDots)
+{
+	int		i = 0;
+	int		j = 0;
+
+	for (;;) {
+		while (aSkipDots && i < aLen && a[i] == '.')
+			i++;
+		while (bSkipDots && j < bLen && b[j] == '.')
+			j++;
+		if (i == aLen || j == bLen)
+			return (i < aLen) - (j < bLen);
+		if (a[i] != b[j])
+			return (unsigned char) a[i] < (unsigned char) b[j] ? -1 : 1;
+		i++;
+		j++;
+	}
+}
+
+/*
+ * Compare two values by their canonical forms, reading the stored values in
+ * place: the provider comes from the byte emailParse() recorded, so nothing
+ * is copied or looked up per comparison.
+ */
+static int
+emailCanonCmp(const Email *a, const Email *b)
+{
+	const EmailProvider *aProvider;
+	const EmailProvider *bProvider;
+	const char *aDomain;
+	const char *bDomain;
+	int		aLenghtLocal;
+	int		aLenghtDomain;
+	int		bLenghtLocal;
+	int		bLenghtDomain;
+	int		result;
+
+	emailSplit(a, &aLenghtLocal, &aLenghtDomain);
+	emailSplit(b, &bLenghtLocal, &bLenghtDomain);
+	aDomain = a->data + aLenghtLocal + 1;
+	bDomain = b->data + bLenghtLocal + 1;
+	aProvider = emailProviderOf(a, aDomain, aLenghtDomain);
+	bProvider = emailProviderOf(b, bDomain, bLenghtDomain);
+	if (aProvider != NULL) {
+		aDomain = aProvider->canonicalDomain;
+		aLenghtDomain = aProvider->canonicalDomainLen;
+	}
+	if (bProvider != NULL) {
+		bDomain = bProvider->canonicalDomain;
+		bLenghtDomain = bProvider->canonicalDomainLen;
+	}
+
+	result = emailPartCmp(aDomain, aLenghtDomain, bDomain, bLenghtDomain);
+	if (result == 0)
+		result = emailLocalCanonCmp(a->data, aLenghtLocal, aProvider != NULL && aProvider->ignoreDots,
+									b->data, bLenghtLocal, bProvider != NULL && bProvider->ignoreDots);
+	return result;
+}
+
+PG_FUNCTION_INFO_V1(email_canon_eq); //Email1 *= Email2
+Datum
+email_canon_eq(PG_FUNCTION_ARGS)
+{
 	Email    *a = (Email *) PG_GETARG_POINTER(0);
 	Email    *b = (Email *) PG_GETARG_POINTER(1);
 
-	//Now we need to get the local lenPG_RETURN_INT32(result);gth of input
-	delimiter = strchr(a->data,'@');
-	aLenghtLocal = delimiter - a->data;
-	delimiter = strchr(b->data,'@');
-	bLenghtLocal = delimiter - b->data;
-	//And next is the domain length	
-	delimiter = strchr(a->data,'#');
-	aLenghtDomain = (int)(delimiter - a->data) - aLenghtLocal -1;
-	delimiter = strchr(b->data,'#');
-	bLenghtDomain = (int)(delimiter - b->data) - bLenghtLocal -1;	
-	
-	aDomain = (char*) palloc0( strlen(a->data) - (aLenghtLocal +1) +1);
-	bDomain = (char*) palloc0( strlen(b->data) - (bLenghtLocal +1) +1);
+	PG_RETURN_BOOL(emailCanonCmp(a, b) == 0);
+}
 
-	//Get the domain
-	memmove(aDomain,a->data + aLenghtLocal + 1,aLenghtDomain);
-	*(aDomain+aLenghtDomain+1)='t';
-	*(aDomain+aLenghtDomain+2)='\0';
-	memmove(bDomain,b->data + bLenghtLocal + 1,bLenghtDomain);
-	*(bDomain+bLenghtDomain+1)='t';
-	*(bDomain+bLenghtDomain+2)='\0';
+PG_FUNCTION_INFO_V1(email_canon_not_eq); //Email1 *<> Email2
+Datum
+email_canon_not_eq(PG_FUNCTION_ARGS)
+{
+	Email    *a = (Email *) PG_GETARG_POINTER(0);
+	Email    *b = (Email *) PG_GETARG_POINTER(1);
 
-	PG_RETURN_BOOL(!(strcmp(aDomain, bDomain) == 0));
+	PG_RETURN_BOOL(emailCanonCmp(a, b) != 0);
 }
 
+PG_FUNCTION_INFO_V1(email_canon_lt); //Email1 *< Email2
+Datum
+email_canon_lt(PG_FUNCTION_ARGS)
+{
+	Email    *a = (Email *) PG_GETARG_POINTER(0);
+	Email    *b = (Email *) PG_GETARG_POINTER(1);
 
+	PG_RETURN_BOOL(emailCanonCmp(a, b) < 0);
+}
 
-PG_FUNCTION_INFO_V1(email_cmp);
-Datum email_cmp(PG_FUNCTION_ARGS)
+PG_FUNCTION_INFO_V1(email_canon_lt_eq); //Email1 *<= Email2
+Datum
+email_canon_lt_eq(PG_FUNCTION_ARGS)
 {
-
-	char* aLocal ;
-	char* bLocal ;
-	char* aDomain ;
-	char* bDomain ;
-	char *delimiter;
-	
-	int aLenghtLocal;
-	int aLenghtDomain;
-	int bLenghtLocal;
-	int bLenghtDomain;
-	int32	result;
-	
 	Email    *a = (Email *) PG_GETARG_POINTER(0);
 	Email    *b = (Email *) PG_GETARG_POINTER(1);
 
-	//Now we need to get the local length of input
-	delimiter = strchr(a->data,'@');
-	aLenghtLocal = delimiter - a->data;
-	delimiter = strchr(b->data,'@');
-	bLenghtLocal = delimiter - b->data;	
-	//And next is the domain length	
-	delimiter = strchr(a->data,'#');
-	aLenghtDomain = (int)(delimiter - a->data) - aLenghtLocal -1;
-	delimiter = strchr(b->data,'#');
-	bLenghtDomain = (int)(delimiter - b->data) - bLenghtLocal -1;
-	//We need to get the local and domain of each input
-	aLocal = (char*) palloc0( aLenghtLocal +1);
-	bLocal = (char*) palloc0( bLenghtLocal +1);
-	aDomain = (char*) palloc0( aLenghtDomain +1);
-	bDomain = (char*) palloc0( bLenghtDomain +1);
-	//Get the local		
-	memmove(aLocal,a->data,aLenghtLocal);
-	*(aLocal+aLenghtLocal+1)='t';
-	*(aLocal+aLenghtLocal+2)='\0';
-	memmove(bLocal,b->data,bLenghtLocal);
-	*(bLocal+bLenghtLocal+1)='t';
-	*(bLocal+bLenghtLocal+2)='\0';	
-	//Get the domain
-	memmove(aDomain,a->data + aLenghtLocal + 1,aLenghtDomain);
-	*(aDomain+aLenghtDomain+1)='t';
-	*(aDomain+aLenghtDomain+2)='\0';
-	memmove(bDomain,b->data + bLenghtLocal + 1,bLenghtDomain);
-	*(bDomain+bLenghtDomain+1)='t';
-	*(bDomain+bLenghtDomain+2)='\0';
-
-	//Compare function
-	result = strcmp(aDomain, bDomain);
-	if (result == 0) {
-		result = strcmp(aLocal, bLocal);
-	}
-	
-	PG_FREE_IF_COPY(a, 0);
-	PG_FREE_IF_COPY(b, 1);
+	PG_RETURN_BOOL(emailCanonCmp(a, b) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(email_canon_gt); //Email1 *> Email2
+Datum
+email_canon_gt(PG_FUNCTION_ARGS)
+{
+	Email    *a = (Email *) PG_GETARG_POINTER(0);
+	Email    *b = (Email *) PG_GETARG_POINTER(1);
 
-	PG_RETURN_INT32(result);
+	PG_RETURN_BOOL(emailCanonCmp(a, b) > 0);
 }
 
+PG_FUNCTION_INFO_V1(email_canon_gt_eq); //Email1 *>= Email2
+Datum
+email_canon_gt_eq(PG_FUNCTION_ARGS)
+{
+	Email    *a = (Email *) PG_GETARG_POINTER(0);
+	Email    *b = (Email *) PG_GETARG_POINTER(1);
 
-PG_FUNCTION_INFO_V1(email_hash);
+	PG_RETURN_BOOL(emailCanonCmp(a, b) >= 0);
+}
+
+PG_FUNCTION_INFO_V1(email_canon_cmp);
 Datum
-email_hash(PG_FUNCTION_ARGS)
+email_canon_cmp(PG_FUNCTION_ARGS)
 {
-	Email *email = (Email *) PG_GETARG_POINTER(0);
-	Datum result;	
-	char *temp;	
-	char *tempRun;	
-	char *str = (char *) palloc0(259);
-	int len;
-	len = 0;
-	temp=email->data;
-	tempRun=str;
-	while(*temp!='#'){
-		*tempRun = *temp;
-		temp++;
-		tempRun++;
-		len++;	
-	}
-	*tempRun='\0';
-	
-        result = hash_any((unsigned char *) str, len);
-	pfree(str);
-	// Avoid leaking memory for toasted inputs 	
-	//PG_FREE_IF_COPY(email, 0);
-	PG_RETURN_DATUM(result);
+	Email    *a = (Email *) PG_GETARG_POINTER(0);
+	Email    *b = (Email *) PG_GETARG_POINTER(1);
+
+	PG_RETURN_INT32(emailCanonCmp(a, b));
 }
 
+PG_FUNCTION_INFO_V1(email_canon_hash);
+Datum
+email_canon_hash(PG_FUNCTION_ARGS)
+{
+	//Same hash as email_hash() of the canonical value
+	Email    *email = (Email *) PG_GETARG_POINTER(0);
+	Email	canon;
+	const char *domain;
+	int		len;
+
+	//Most addresses are their own canonical form and are hashed in place
+	domain = emailDomain(email, &len);
+	if (emailProviderOf(email, domain, len) == NULL) {
+		len = strchr(email->data, '#') - email->data;
+		PG_RETURN_DATUM(hash_any((unsigned char *) email->data, len));
+	}
 
+	len = emailCanonicalize(email, &canon);
+	PG_RETURN_DATUM(hash_any((unsigned char *) canon.data, len));
+}
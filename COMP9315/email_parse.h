@@ -0,0 +1,173 @@
+/*
+ * email_parse.h
+ *
+ ******************************************************************************
+  The EmailAddress parser. It is shared by the backend module (email.c) and
+  the offline validator (email_validate.c), so it must not use anything from
+  the backend. Instead of raising an error it returns the message that
+  email_in reports, or NULL when the address is valid.
+******************************************************************************/
+
+#ifndef EMAIL_PARSE_H
+#define EMAIL_PARSE_H
+
+#include <ctype.h>
+#include <string.h>
+
+//Switch to the new struct
+typedef struct Email
+{
+	/* The structure will contain both Local and Domain part of 1 Email Address
+	 * Local@Domain#
+	 * Follow the statement there is no sign except . and - in the string
+	 * So we can use @ and # to compute the length of local and domain part
+	 * The maximum string will be 129 + 129 + 1(for @) + 1(for #);
+	 * The last byte is not part of the string, it records the provider
+	 * found by emailParse() (see EMAIL_PROVIDER_BYTE).
+	 * Every byte between the '#' and the provider byte must be zero:
+	 * emailEq() in email.c compares the first 64 bytes whatever the length,
+	 * so anything that builds an Email has to start from zeroed memory.
+	 */
+	char data[260];
+}	Email;
+
+#define EMAIL_PART_MAX 128
+
+/*
+ * Providers that deliver mail for several spellings of one mailbox, used by
+ * the canonical equivalence operators. emailParse() looks the domain up once
+ * and stores the result in data[EMAIL_PROVIDER_BYTE]: EMAIL_PROVIDER_NONE,
+ * or EMAIL_PROVIDER_FIRST + the index into emailProviders. Values stored
+ * before the byte existed have EMAIL_PROVIDER_UNKNOWN there.
+ */
+typedef struct EmailProvider
+{
+	const char *domain;
+	int			domainLen;
+	const char *canonicalDomain;
+	int			canonicalDomainLen;
+	int			ignoreDots;		/* "j.doe" and "jdoe" are the same mailbox */
+}	EmailProvider;
+
+#define EMAIL_PROVIDER(domain, canonical, ignoreDots) \
+	{domain, sizeof(domain) - 1, canonical, sizeof(canonical) - 1, ignoreDots}
+
+static const EmailProvider emailProviders[] = {
+	EMAIL_PROVIDER("gmail.com", "gmail.com", 1),
+	EMAIL_PROVIDER("googlemail.com", "gmail.com", 1)
+};
+
+#define EMAIL_PROVIDER_BYTE (sizeof(((Email *) 0)->data) - 1)
+#define EMAIL_PROVIDER_UNKNOWN 0
+#define EMAIL_PROVIDER_NONE 1
+#define EMAIL_PROVIDER_FIRST 2
+
+//Return the provider byte for a domain
+static int
+emailFindProvider(const char *domain, int len)
+{
+	int		i;
+
+	for (i = 0; i < (int) (sizeof(emailProviders) / sizeof(emailProviders[0])); i++) {
+		if (emailProviders[i].domainLen == len &&
+			memcmp(emailProviders[i].domain, domain, len) == 0)
+			return EMAIL_PROVIDER_FIRST + i;
+	}
+	return EMAIL_PROVIDER_NONE;
+}
+
+//Function to check the content of Local and Domain part of EmailAddress
+static const char *
+checkString(const char *str)
+{
+	//Check the first character of the part is a letter
+	if (!isalpha((unsigned char) *str))
+		return "Error: Only a letter can begin a word";
+
+	//Loop through the part
+	//Check if there is another sign except . amd - in the string
+	//Check the format of the rest
+	while (*str != '\0') {
+		if (!isalnum((unsigned char) *str)) {
+			if (*str != '.' && *str != '-')
+				return "Error: Only letters, numbers, '.', and '-' allowed";
+			//Check if after a . there is only letter
+			if (*str == '.') {
+				//A word begin with a letter
+				if (!isalpha((unsigned char) *(str + 1)))
+					return "Error: Only a letter can begin a word";
+				//A word end with a letter or digit
+				if (!isalnum((unsigned char) *(str - 1)))
+					return "Error: Only a letter or digit can end a word";
+			}
+		}
+		str++;
+	}
+
+	//Last check if the end is a number or a digit
+	if (!isalnum((unsigned char) *(str - 1)))
+		return "Error: Only a letter or dtempigit can end a word";
+
+	return NULL;
+}
+
+/*
+ * Parse the len bytes at in into result, which must be zeroed by the caller.
+ * Local and domain part are folded to lower case and stored as "local@domain#".
+ */
+static const char *
+emailParse(const char *in, int len, Email *result)
+{
+	char	local[EMAIL_PART_MAX + 1];
+	char	domain[EMAIL_PART_MAX + 1];
+	char   *str;
+	const char *error;
+	int		count;
+	int		isDomain;
+	int		i;
+
+	isDomain = 0;
+	str = local;
+	count = 0;
+	*domain = '\0';
+
+	for (i = 0; i < len; i++) {
+		if (in[i] == '@') {
+			if (isDomain != 0)
+				return "Error: Cannot have more than one '@' in an email";
+			isDomain = 1;
+			count = 0;
+			*str = '\0';
+			str = domain;
+		}
+		else {
+			if (count == EMAIL_PART_MAX)
+				return "Error: Only 128 characters allowed in Local or Domain part";
+			*str++ = tolower((unsigned char) in[i]);
+			count++;
+		}
+	}
+	*str = '\0';
+
+	if ((error = checkString(local)) != NULL)
+		return error;
+	//In the case of Domain part we have to add this check before the main check above
+	//Special check if there is a . exist in the string
+	if (strchr(domain, '.') == NULL)
+		return "Error: Domain part must contain at least one '.'";
+	if ((error = checkString(domain)) != NULL)
+		return error;
+
+	//Adding the region to output result
+	str = result->data;
+	memcpy(str, local, strlen(local));
+	str += strlen(local);
+	*str++ = '@';
+	memcpy(str, domain, strlen(domain));
+	str += strlen(domain);
+	*str = '#';
+	result->data[EMAIL_PROVIDER_BYTE] = emailFindProvider(domain, strlen(domain));
+	return NULL;
+}
+
+#endif							/* EMAIL_PARSE_H */
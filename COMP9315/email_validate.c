@@ -0,0 +1,453 @@
+/*
+ * email_validate.c
+ *
+ ******************************************************************************
+  Offline validator for files that will be loaded into EmailAddress columns.
+  It uses the same parser as email_in (email_parse.h), so a row it accepts
+  will not be rejected by COPY and the reasons match the server's messages.
+
+  Rows are split the way COPY ... (FORMAT csv) splits them: a field may be
+  wrapped in double quotes, "" inside quotes is a literal quote, and a
+  newline inside quotes belongs to the field. The input is memory mapped
+  and cut into one chunk per thread at row boundaries. Whether a position is
+  inside quotes follows from the number of quotes before it, so one parallel
+  pass counts the quotes of each part before the cut points are chosen.
+  Each thread only records which parts of its chunk are valid or rejected,
+  the main thread then writes them out in input order.
+
+  Like COPY, the line ending is taken from the first row: after a CRLF every
+  row must end in CRLF, otherwise an unquoted carriage return is an error.
+  An unquoted empty address field is NULL and passes unless -n is given;
+  a quoted empty field ("") is an empty string and is rejected by the parser.
+
+  Build:  cc -O2 -pthread -o email_validate email_validate.c
+  Usage:  email_validate [-j threads] [-d delimiter] [-f field] [-H] [-n]
+                         input valid-output rejected-output
+
+  -f picks the 1-based field holding the address (default 1), -d the field
+  delimiter (default ','), -H copies a header row to the valid output, -n
+  rejects NULL addresses for columns declared NOT NULL.
+  Rejected rows are written as "line<TAB>reason<TAB>row", where line counts
+  rows the way COPY does and row is the original row, quoted newlines
+  included. The exit status is 3 when any row was rejected.
+******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "email_parse.h"
+
+#define MAX_THREADS 256
+#define OUTPUT_BUFFER (1 << 20)
+
+//A run of consecutive valid rows, written with one fwrite
+typedef struct Segment
+{
+	size_t	start;
+	size_t	len;
+}	Segment;
+
+typedef struct Reject
+{
+	size_t	line;			/* row number inside the chunk, from 1 */
+	size_t	start;
+	size_t	len;
+	const char *reason;
+}	Reject;
+
+typedef struct Chunk
+{
+	const char *data;		/* the whole mapped file */
+	size_t	start;
+	size_t	end;
+	size_t	quotes;			/* quotes in [start, end), first pass only */
+	size_t	lines;
+	char   *field;			/* the address field with quoting removed */
+	size_t	maxfield;
+	Segment *valid;
+	size_t	nvalid;
+	size_t	maxvalid;
+	Reject *rejected;
+	size_t	nrejected;
+	size_t	maxrejected;
+}	Chunk;
+
+static int field = 1;
+static char delimiter = ',';
+static int notNull = 0;
+static int crlf = 0;			/* rows end in \r\n, set from the first row */
+
+static void *
+growArray(void *array, size_t *max, size_t size)
+{
+	*max = *max == 0 ? 1024 : *max * 2;
+	array = realloc(array, *max * size);
+	if (array == NULL) {
+		fprintf(stderr, "email_validate: out of memory\n");
+		exit(1);
+	}
+	return array;
+}
+
+/*
+ * Return the end of the row starting at pos: the newline that ends it, or
+ * end. inQuote tells whether pos itself is inside quotes.
+ */
+static const char *
+rowEnd(const char *pos, const char *end, int inQuote)
+{
+	while (pos < end) {
+		const char *newline = memchr(pos, '\n', end - pos);
+		const char *stop = newline != NULL ? newline : end;
+		const char *quote;
+
+		//Every quote toggles, "" inside quotes toggles twice
+		while ((quote = memchr(pos, '"', stop - pos)) != NULL) {
+			inQuote = !inQuote;
+			pos = quote + 1;
+		}
+		if (!inQuote || newline == NULL)
+			return stop;
+		pos = newline + 1;
+	}
+	return end;
+}
+
+static void *
+countQuotes(void *arg)
+{
+	Chunk  *chunk = (Chunk *) arg;
+	const char *pos = chunk->data + chunk->start;
+	const char *end = chunk->data + chunk->end;
+
+	while ((pos = memchr(pos, '"', end - pos)) != NULL) {
+		chunk->quotes++;
+		pos++;
+	}
+	return NULL;
+}
+
+/*
+ * Copy the address field of a row into chunk->field, removing quotes the
+ * way COPY ... CSV does, and tell whether it was quoted. Returns the reason
+ * when COPY would reject the row or it cannot hold an address.
+ */
+static const char *
+extractField(Chunk *chunk, const char *row, const char *end, int *len, int *quoted)
+{
+	int		current = 1;
+	int		inQuote = 0;
+	size_t	n = 0;
+
+	*quoted = 0;
+	for (; row < end; row++) {
+		char	c = *row;
+
+		if (inQuote) {
+			if (c == '"') {
+				if (row + 1 < end && row[1] == '"')
+					row++;
+				else {
+					inQuote = 0;
+					continue;
+				}
+			}
+		}
+		else if (c == '"') {
+			inQuote = 1;
+			if (current == field)
+				*quoted = 1;
+			continue;
+		}
+		else if (c == delimiter) {
+			current++;
+			continue;
+		}
+		else if (c == '\r')
+			return "Error: Unquoted carriage return found in data";
+
+		if (current == field) {
+			if (n == chunk->maxfield)
+				chunk->field = growArray(chunk->field, &chunk->maxfield, 1);
+			chunk->field[n++] = c;
+		}
+	}
+
+	if (inQuote)
+		return "Error: Unterminated CSV quoted field";
+	if (current < field)
+		return "Error: Row has no address field";
+	*len = n;
+	return NULL;
+}
+
+static void
+validateRow(Chunk *chunk, size_t start, size_t len)
+{
+	const char *row = chunk->data + start;
+	const char *reason = NULL;
+	int		addressLen = 0;
+	int		quoted = 0;
+	size_t	dataLen = len;
+	Email	email;
+
+	//In a CRLF file the \r belongs to the line ending, not to the last field
+	if (crlf && start + len < chunk->end) {
+		if (len > 0 && row[len - 1] == '\r')
+			dataLen--;
+		else
+			reason = "Error: Unquoted newline found in data";
+	}
+	if (reason == NULL)
+		reason = extractField(chunk, row, row + dataLen, &addressLen, &quoted);
+	if (reason == NULL && addressLen == 0 && !quoted) {
+		//COPY reads an unquoted empty field as NULL
+		if (notNull)
+			reason = "Error: Null value in a NOT NULL address column";
+	}
+	else if (reason == NULL) {
+		memset(&email, 0, sizeof(Email));
+		reason = emailParse(chunk->field, addressLen, &email);
+	}
+
+	if (reason == NULL) {
+		//Include the newline so consecutive valid rows merge into one segment
+		size_t	withNewline = start + len < chunk->end ? len + 1 : len;
+
+		if (chunk->nvalid > 0 &&
+			chunk->valid[chunk->nvalid - 1].start + chunk->valid[chunk->nvalid - 1].len == start) {
+			chunk->valid[chunk->nvalid - 1].len += withNewline;
+		}
+		else {
+			if (chunk->nvalid == chunk->maxvalid)
+				chunk->valid = growArray(chunk->valid, &chunk->maxvalid, sizeof(Segment));
+			chunk->valid[chunk->nvalid].start = start;
+			chunk->valid[chunk->nvalid].len = withNewline;
+			chunk->nvalid++;
+		}
+	}
+	else {
+		if (chunk->nrejected == chunk->maxrejected)
+			chunk->rejected = growArray(chunk->rejected, &chunk->maxrejected, sizeof(Reject));
+		chunk->rejected[chunk->nrejected].line = chunk->lines;
+		chunk->rejected[chunk->nrejected].start = start;
+		chunk->rejected[chunk->nrejected].len = len;
+		chunk->rejected[chunk->nrejected].reason = reason;
+		chunk->nrejected++;
+	}
+}
+
+static void *
+validateChunk(void *arg)
+{
+	Chunk  *chunk = (Chunk *) arg;
+	const char *end = chunk->data + chunk->end;
+	size_t	pos = chunk->start;
+
+	//Chunks start at a row boundary, so outside quotes
+	while (pos < chunk->end) {
+		size_t	len = rowEnd(chunk->data + pos, end, 0) - (chunk->data + pos);
+
+		chunk->lines++;
+		validateRow(chunk, pos, len);
+		pos += len + 1;
+	}
+	return NULL;
+}
+
+//Run fn on every chunk, one thread each
+static void
+runThreads(Chunk *chunks, int nthreads, void *(*fn) (void *))
+{
+	pthread_t threads[MAX_THREADS];
+	int		i;
+
+	for (i = 0; i < nthreads; i++) {
+		int		rc = pthread_create(&threads[i], NULL, fn, &chunks[i]);
+
+		if (rc != 0) {
+			fprintf(stderr, "email_validate: cannot start thread: %s\n", strerror(rc));
+			exit(1);
+		}
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static FILE *
+openOutput(const char *path)
+{
+	FILE   *file = fopen(path, "w");
+
+	if (file == NULL) {
+		fprintf(stderr, "email_validate: cannot open \"%s\": %s\n", path, strerror(errno));
+		exit(1);
+	}
+	setvbuf(file, NULL, _IOFBF, OUTPUT_BUFFER);
+	return file;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: email_validate [-j threads] [-d delimiter] [-f field] [-H] [-n] input valid-output rejected-output\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	int		nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	int		header = 0;
+	int		opt;
+	int		fd;
+	struct stat st;
+	const char *data = NULL;
+	size_t	size;
+	size_t	bodyStart = 0;
+	size_t	lineOffset;
+	size_t	nvalidRows = 0;
+	size_t	nrejectedRows = 0;
+	FILE   *validFile;
+	FILE   *rejectedFile;
+	size_t	quotes;
+	Chunk	chunks[MAX_THREADS];
+	int		i;
+
+	while ((opt = getopt(argc, argv, "j:d:f:Hn")) != -1) {
+		switch (opt) {
+			case 'j':
+				nthreads = atoi(optarg);
+				break;
+			case 'd':
+				if (strlen(optarg) != 1)
+					usage();
+				delimiter = optarg[0];
+				break;
+			case 'f':
+				field = atoi(optarg);
+				if (field < 1)
+					usage();
+				break;
+			case 'H':
+				header = 1;
+				break;
+			case 'n':
+				notNull = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind != 3)
+		usage();
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "email_validate: cannot open \"%s\": %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	size = st.st_size;
+	if (size > 0) {
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "email_validate: cannot map \"%s\": %s\n", argv[optind], strerror(errno));
+			return 1;
+		}
+		madvise((void *) data, size, MADV_SEQUENTIAL);
+	}
+
+	validFile = openOutput(argv[optind + 1]);
+	rejectedFile = openOutput(argv[optind + 2]);
+
+	//Pick the line ending from the first row, header or not
+	if (size > 0) {
+		size_t	firstEnd = rowEnd(data, data + size, 0) - data;
+
+		crlf = firstEnd < size && firstEnd > 0 && data[firstEnd - 1] == '\r';
+	}
+
+	if (header && size > 0) {
+		bodyStart = rowEnd(data, data + size, 0) - data;
+		if (bodyStart < size)
+			bodyStart++;
+		fwrite(data, 1, bodyStart, validFile);
+	}
+
+	//Count the quotes of equal parts of the body, in parallel
+	for (i = 0; i < nthreads; i++) {
+		memset(&chunks[i], 0, sizeof(Chunk));
+		chunks[i].data = data;
+		chunks[i].start = bodyStart + (size - bodyStart) / nthreads * i;
+		if (i > 0)
+			chunks[i - 1].end = chunks[i].start;
+	}
+	chunks[nthreads - 1].end = size;
+	runThreads(chunks, nthreads, countQuotes);
+
+	//Move each cut forward to the next row boundary, i.e. the first newline
+	//outside quotes; an odd number of quotes before a cut means it is inside
+	quotes = 0;
+	for (i = 1; i < nthreads; i++) {
+		size_t	start = chunks[i].start;
+
+		quotes += chunks[i - 1].quotes;
+		if (start <= chunks[i - 1].start)
+			start = chunks[i - 1].start;
+		else if (!(data[start - 1] == '\n' && quotes % 2 == 0))
+			start = rowEnd(data + start, data + size, quotes % 2) - data + 1;
+		if (start > size)
+			start = size;
+		chunks[i].start = start;
+	}
+	for (i = 0; i < nthreads; i++) {
+		chunks[i].end = i + 1 < nthreads ? chunks[i + 1].start : size;
+		chunks[i].quotes = 0;
+	}
+	runThreads(chunks, nthreads, validateChunk);
+
+	//Write the chunks in input order
+	lineOffset = header ? 1 : 0;
+	for (i = 0; i < nthreads; i++) {
+		Chunk  *chunk = &chunks[i];
+		size_t	j;
+
+		for (j = 0; j < chunk->nvalid; j++)
+			fwrite(data + chunk->valid[j].start, 1, chunk->valid[j].len, validFile);
+		for (j = 0; j < chunk->nrejected; j++) {
+			Reject *reject = &chunk->rejected[j];
+
+			fprintf(rejectedFile, "%zu\t%s\t", lineOffset + reject->line, reject->reason);
+			fwrite(data + reject->start, 1, reject->len, rejectedFile);
+			fputc('\n', rejectedFile);
+		}
+		nrejectedRows += chunk->nrejected;
+		nvalidRows += chunk->lines - chunk->nrejected;
+		lineOffset += chunk->lines;
+		free(chunk->valid);
+		free(chunk->rejected);
+		free(chunk->field);
+	}
+
+	if (fclose(validFile) != 0 || fclose(rejectedFile) != 0) {
+		fprintf(stderr, "email_validate: cannot write output: %s\n", strerror(errno));
+		return 1;
+	}
+	if (size > 0)
+		munmap((void *) data, size);
+	close(fd);
+
+	fprintf(stderr, "email_validate: %zu valid, %zu rejected\n", nvalidRows, nrejectedRows);
+	return nrejectedRows > 0 ? 3 : 0;
+}